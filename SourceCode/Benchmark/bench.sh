@@ -0,0 +1,271 @@
+#!/usr/bin/env bash
+#
+# Loopback benchmark of gfserver_main driven by gfclient_download.
+#
+# Generates a synthetic corpus with its content and workload files, then
+# for each client thread count starts a fresh server on a free loopback
+# port and runs the client once.  Each run prints one row: throughput, the
+# 50th, 90th and 99th percentile download time, CPU and peak RSS of both
+# processes during that run, and
+# whether the client received every byte it should have.  The client
+# reports its own download times (-l) and resource usage at exit.
+# The corpus is seeded, so the same profile always has the same file
+# sizes.  Everything is done in a scratch directory that is removed on
+# exit.  With -C the corpus is evicted from the page cache before each
+# run, so the server reads it from disk; the scratch directory must then
+# be on a disk backed filesystem, not tmpfs (see -d).  With -b every run
+# is repeated against a baseline server, and -c size:BYTES makes a corpus
+# of files of one size, so a loop over sizes gives throughput curves of
+# both servers.
+
+set -euo pipefail
+
+USAGE="usage:
+  bench.sh [options] server_bin client_bin
+options:
+  -c [profile]        Corpus profile: tiny, mixed, huge, or size:BYTES for
+                      files of that one size (Default: mixed)
+  -n [num_requests]   Requests download per client thread (Default: 64)
+  -t [\"n1 n2 ...\"]    Client thread counts to run (Default: \"1 4 16 32\")
+  -T [nthreads]       Server threads (Default: 64)
+  -s [seed]           Seed for the corpus file sizes (Default: 12041)
+  -b [server_bin]     Baseline server, each run is repeated against it
+  -C                  Cold: evict the corpus from the page cache before each run
+  -d [dir]            Directory to create the scratch directory in
+                      (Default: \$TMPDIR or /tmp)
+  -k                  Keep the scratch directory
+  -h                  Show this help message"
+
+profile=mixed
+nrequests=64
+client_threads="1 4 16 32"
+server_threads=64
+seed=12041
+keep=0
+cold=0
+baseline_bin=
+scratch_parent=${TMPDIR:-/tmp}
+
+while getopts "c:n:t:T:s:b:Cd:kh" opt; do
+  case $opt in
+    c) profile=$OPTARG ;;
+    n) nrequests=$OPTARG ;;
+    t) client_threads=$OPTARG ;;
+    T) server_threads=$OPTARG ;;
+    s) seed=$OPTARG ;;
+    b) baseline_bin=$(readlink -f "$OPTARG") ;;
+    C) cold=1 ;;
+    d) scratch_parent=$OPTARG ;;
+    k) keep=1 ;;
+    h) echo "$USAGE"; exit 0 ;;
+    *) echo "$USAGE" >&2; exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -ne 2 ]; then
+  echo "$USAGE" >&2
+  exit 1
+fi
+server_bin=$(readlink -f "$1")
+client_bin=$(readlink -f "$2")
+
+# Number of files, smallest and largest size for each profile.  Sizes are
+# drawn log-uniformly between the two, so "mixed" covers every order of
+# magnitude equally.  A single size corpus has about 256 MB of files, at
+# least 8 and at most 256 of them.
+case $profile in
+  size:*)
+    min_size=${profile#size:}
+    [[ "$min_size" =~ ^[1-9][0-9]*$ ]] || { echo "Bad file size in $profile" >&2; exit 1; }
+    max_size=$min_size
+    nfiles=$((256 * 1024 * 1024 / min_size))
+    nfiles=$((nfiles < 8 ? 8 : (nfiles > 256 ? 256 : nfiles))) ;;
+  tiny)  nfiles=2000; min_size=128;       max_size=4096 ;;
+  mixed) nfiles=500;  min_size=1024;      max_size=$((16 * 1024 * 1024)) ;;
+  huge)  nfiles=8;    min_size=$((256 * 1024 * 1024)); max_size=$((512 * 1024 * 1024)) ;;
+  *) echo "Unknown corpus profile $profile" >&2; exit 1 ;;
+esac
+
+# Pages of a tmpfs file only live in memory, there is nothing to evict them to
+if [ $cold -eq 1 ]; then
+  case $(stat -f -c %T "$scratch_parent") in
+    tmpfs|ramfs)
+      echo "$scratch_parent is $(stat -f -c %T "$scratch_parent"), -C needs a disk backed -d directory" >&2
+      exit 1 ;;
+  esac
+fi
+
+scratch=$(mktemp -d "$scratch_parent/gfbench.XXXXXX")
+server_pid=
+cleanup() {
+  if [ -n "$server_pid" ]; then
+    kill "$server_pid" 2>/dev/null || true
+    wait "$server_pid" 2>/dev/null || true
+  fi
+  if [ $keep -eq 0 ]; then
+    rm -rf "$scratch"
+  else
+    echo "Kept $scratch" >&2
+  fi
+}
+trap cleanup EXIT
+
+# Corpus ==================================================================
+mkdir -p "$scratch/corpus"
+awk -v n=$nfiles -v lo=$min_size -v hi=$max_size -v seed=$seed 'BEGIN {
+  srand(seed)
+  for (i = 0; i < n; i++)
+    printf "%06d %d\n", i, (lo == hi) ? lo : int(exp(log(lo) + rand() * (log(hi) - log(lo))))
+}' > "$scratch/sizes.txt"
+
+# Contents do not matter, only the sizes, so every file is a prefix of one
+# random pool file that is as large as the largest file.
+head -c "$max_size" /dev/urandom > "$scratch/pool"
+while read -r id size; do
+  head -c "$size" "$scratch/pool" > "$scratch/corpus/$id"
+  echo "/corpus/$id $scratch/corpus/$id" >> "$scratch/content.txt"
+  echo "/corpus/$id" >> "$scratch/workload.txt"
+done < "$scratch/sizes.txt"
+rm -f "$scratch/pool"
+
+# The client requests the workload in order, wrapping around, so the bytes
+# a run must download follow from the sizes alone.
+expected_bytes() {
+  awk -v total=$(($1 * nrequests)) '{ size[NR - 1] = $2 } END {
+    for (i = 0; i < total; i++) sum += size[i % NR]
+    printf "%.0f\n", sum
+  }' "$scratch/sizes.txt"
+}
+
+# Server ==================================================================
+port_listening() {
+  local hex
+  hex=$(printf ':%04X ' "$1")
+  grep -q "$hex" /proc/net/tcp /proc/net/tcp6 2>/dev/null
+}
+
+port=
+for _ in $(seq 1 100); do
+  candidate=$((20000 + RANDOM % 40000))
+  if ! port_listening $candidate; then
+    port=$candidate
+    break
+  fi
+done
+if [ -z "$port" ]; then
+  echo "No free port found" >&2
+  exit 1
+fi
+
+# The server ($1) is started afresh for every run, so its peak RSS is that run's
+start_server() {
+  (cd "$scratch" && exec "$1" -p "$port" -t "$server_threads" -m content.txt \
+    > "$scratch/server.log" 2>&1) &
+  server_pid=$!
+
+  for _ in $(seq 1 100); do
+    port_listening "$port" && return 0
+    kill -0 "$server_pid" 2>/dev/null || { cat "$scratch/server.log" >&2; exit 1; }
+    sleep 0.1
+  done
+  echo "Server did not start listening on port $port" >&2
+  exit 1
+}
+
+stop_server() {
+  kill "$server_pid" 2>/dev/null || true
+  wait "$server_pid" 2>/dev/null || true
+  server_pid=
+  for _ in $(seq 1 100); do
+    port_listening "$port" || return 0
+    sleep 0.1
+  done
+}
+
+# Drops the corpus from the page cache.  As root the whole cache is
+# dropped, which also drops the dentries and inodes of the corpus;
+# otherwise each file's pages are dropped (dd's nocache flag does a
+# POSIX_FADV_DONTNEED over the file).  Dirty pages can't be dropped, so
+# everything is synced first.
+evict_corpus() {
+  sync
+  if [ -w /proc/sys/vm/drop_caches ]; then
+    echo 3 > /proc/sys/vm/drop_caches
+  else
+    for f in "$scratch"/corpus/*; do
+      dd if="$f" iflag=nocache count=0 status=none
+    done
+  fi
+}
+
+# utime + stime of the running server in clock ticks, and its peak RSS in KB
+cpu_ticks() {
+  awk '{ print $14 + $15 }' "/proc/$1/stat" 2>/dev/null
+}
+peak_rss_kb() {
+  awk '/VmHWM/ { print $2 }' "/proc/$1/status" 2>/dev/null
+}
+ticks=$(getconf CLK_TCK)
+
+# Runs ====================================================================
+[ $cold -eq 0 ] || echo "Corpus in $scratch_parent, evicted from the page cache before each run"
+printf "%-14s %-6s %8s %10s %12s %10s %10s %10s %8s %8s %8s %12s %12s %6s\n" \
+  profile server threads requests bytes seconds "req/s" "MB/s" p50 p90 p99 "client_cpu" "server_cpu" check
+printf "%-14s %-6s %8s %10s %12s %10s %10s %10s %8s %8s %8s %12s %12s %6s\n" \
+  "" "" "" "" "" "" "" "" ms ms ms "s (rss MB)" "s (rss MB)" ""
+
+# Runs the client with $1 threads against server binary $2, printing a row labelled $3
+run() {
+  local threads=$1
+  rm -rf "$scratch/download"
+  mkdir "$scratch/download"
+
+  start_server "$2"
+  [ $cold -eq 0 ] || evict_corpus
+  server_cpu_before=$(cpu_ticks $server_pid)
+  start_ns=$(date +%s%N)
+  (cd "$scratch/download" && exec "$client_bin" -s 127.0.0.1 -p "$port" -t "$threads" \
+    -n "$nrequests" -w "$scratch/workload.txt" -l "$scratch/latency.txt" \
+    > "$scratch/client.log" 2>&1) || { echo "Client failed, see $scratch/client.log" >&2; keep=1; exit 1; }
+  end_ns=$(date +%s%N)
+  server_cpu_after=$(cpu_ticks $server_pid)
+  server_rss_kb=$(peak_rss_kb $server_pid)
+  stop_server
+
+  # "CPU: user 0.123s, sys 0.456s, max RSS 7890 KB", printed by the client at exit.
+  # Reported as 0 if the line is missing.
+  client_cpu=0
+  client_rss_kb=0
+  read -r client_cpu client_rss_kb < <(awk '/^CPU: user/ {
+    gsub(/[s,]/, "", $3); gsub(/[s,]/, "", $5); print $3 + $5, $8 }' "$scratch/client.log") || true
+
+  # Nearest rank percentiles of the download times, in ms
+  read -r p50 p90 p99 < <(sort -n "$scratch/latency.txt" 2>/dev/null | awk '{ t[NR] = $1 } END {
+    n = split("50 90 99", p, " ")
+    for (i = 1; i <= n; i++) {
+      r = int((p[i] * NR + 99) / 100)
+      printf "%s%.2f", (i > 1 ? " " : ""), (r > 0 ? t[r] : 0) / 1e3
+    }
+    print ""
+  }') || true
+
+  requests=$((threads * nrequests))
+  bytes=$(find "$scratch/download" -type f -printf '%s\n' | awk '{ s += $1 } END { printf "%.0f\n", s }')
+  check=ok
+  [ "$bytes" = "$(expected_bytes "$threads")" ] || check=FAIL
+
+  awk -v p=$profile -v sv=$3 -v t=$threads -v r=$requests -v b=$bytes -v s=$(((end_ns - start_ns) / 1000)) \
+      -v p50=${p50:-0} -v p90=${p90:-0} -v p99=${p99:-0} \
+      -v cc=${client_cpu:-0} -v cr=${client_rss_kb:-0} -v sc=$((server_cpu_after - server_cpu_before)) \
+      -v tk=$ticks -v sr=${server_rss_kb:-0} -v ck=$check 'BEGIN {
+    s /= 1e6
+    printf "%-14s %-6s %8d %10d %12.0f %10.2f %10.1f %10.1f %8.2f %8.2f %8.2f %5.2f (%4d) %5.2f (%4d) %6s\n",
+      p, sv, t, r, b, s, r / s, b / s / 1e6, p50, p90, p99, cc, cr / 1024, sc / tk, sr / 1024, ck
+  }'
+}
+
+for threads in $client_threads; do
+  run "$threads" "$server_bin" new
+  [ -z "$baseline_bin" ] || run "$threads" "$baseline_bin" base
+done
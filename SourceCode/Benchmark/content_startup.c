@@ -0,0 +1,154 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "content.h"
+#include "content_index.h"
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  content_startup [options] index_file\n"                                    \
+"Writes a synthetic binary content index with nitems entries to index_file,\n"\
+"then times content_init on it and nlookups random content_open calls.\n"     \
+"The entries point to files that do not exist, so every lookup pays the\n"    \
+"search and one failed open.\n"                                               \
+"options:\n"                                                                  \
+"  -n [nitems]         Number of index entries (Default: 1000000)\n"          \
+"  -l [nlookups]       Number of random lookups (Default: 100000)\n"          \
+"  -s [seed]           Seed for the lookup keys (Default: 12041)\n"           \
+"  -h                  Show this help message.\n"                             \
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] = {
+  {"nitems",        required_argument,      NULL,           'n'},
+  {"nlookups",      required_argument,      NULL,           'l'},
+  {"seed",          required_argument,      NULL,           's'},
+  {"help",          no_argument,            NULL,           'h'},
+  {NULL,            0,                      NULL,             0}
+};
+
+#define KEY_FORMAT "/f%09zu"
+#define PATH_PREFIX "/nonexistent"
+#define KEY_LEN 11  /* strlen of KEY_FORMAT output */
+#define MAX_ITEMS 999999999  /* the most keys KEY_FORMAT can number */
+
+static double elapsed(const struct timespec *start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Writes an index in the layout of content_index.h.  The keys are zero
+// padded, so generating them in order also sorts them.
+static void writeSyntheticIndex(const char *filename, size_t n) {
+  content_index_header_t header;
+  content_index_entry_t record;
+  uint64_t entryLen = (KEY_LEN + 1) + (strlen(PATH_PREFIX) + KEY_LEN + 1);
+  char key[32];
+  FILE *out;
+
+  if (NULL == (out = fopen(filename, "w"))) {
+    perror(filename);
+    exit(EXIT_FAILURE);
+  }
+
+  memcpy(header.magic, CONTENT_INDEX_MAGIC, CONTENT_INDEX_MAGIC_LEN);
+  header.nitems = n;
+  header.strings = sizeof(header) + n * sizeof(record);
+  if (1 != fwrite(&header, sizeof(header), 1, out)) goto fail;
+
+  memset(&record, 0, sizeof(record));
+  for (size_t i = 0; i < n; i++) {
+    record.key = i * entryLen;
+    record.path = record.key + KEY_LEN + 1;
+    if (1 != fwrite(&record, sizeof(record), 1, out)) goto fail;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    snprintf(key, sizeof(key), KEY_FORMAT, i);
+    if (EOF == fputs(key, out) || EOF == fputc('\0', out) ||
+        EOF == fputs(PATH_PREFIX, out) || EOF == fputs(key, out) ||
+        EOF == fputc('\0', out))
+      goto fail;
+  }
+
+  if (0 == fclose(out))
+    return;
+  out = NULL;
+
+fail:
+  perror(filename);
+  if (out) fclose(out);
+  unlink(filename);
+  exit(EXIT_FAILURE);
+}
+
+/* Main ==================================================================== */
+int main(int argc, char **argv) {
+  size_t nitems = 1000000;
+  size_t nlookups = 100000;
+  unsigned int seed = 12041;
+  char key[32];
+  struct timespec start;
+  double initTime, lookupTime;
+  size_t found = 0;
+  int option_char;
+
+  while ((option_char = getopt_long(argc, argv, "n:l:s:h", gLongOptions, NULL)) != -1) {
+    switch (option_char) {
+      case 'n': // nitems
+        nitems = strtoull(optarg, NULL, 10);
+        break;
+      case 'l': // nlookups
+        nlookups = strtoull(optarg, NULL, 10);
+        break;
+      case 's': // seed
+        seed = strtoul(optarg, NULL, 10);
+        break;
+      case 'h': // help
+        fprintf(stdout, "%s", USAGE);
+        exit(0);
+        break;
+      default:
+        fprintf(stderr, "%s", USAGE);
+        exit(1);
+    }
+  }
+
+  if (optind + 1 != argc || nitems == 0 || nitems > MAX_ITEMS) {
+    fprintf(stderr, "%s", USAGE);
+    exit(1);
+  }
+
+  writeSyntheticIndex(argv[optind], nitems);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  content_init(argv[optind]);
+  initTime = elapsed(&start);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t i = 0; i < nlookups; i++) {
+    // One lookup in 16 is for a key past the last entry, so misses are timed too
+    if (i % 16 == 0) {
+      snprintf(key, sizeof(key), KEY_FORMAT, nitems);
+    } else {
+      snprintf(key, sizeof(key), KEY_FORMAT, (size_t) rand_r(&seed) % nitems);
+      found++;
+    }
+    int fd = content_open(key);
+    if (fd >= 0)
+      close(fd);
+  }
+  lookupTime = elapsed(&start);
+
+  content_destroy();
+
+  printf("entries %zu  content_init %.3f ms  lookups %zu (%zu present)  %.3f us/lookup\n",
+         nitems, initTime * 1e3, nlookups, found, nlookups ? lookupTime * 1e6 / nlookups : 0.0);
+  return 0;
+}
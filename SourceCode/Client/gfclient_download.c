@@ -9,33 +9,63 @@
 #include <netinet/in.h>
 #include <getopt.h>
 #include <sys/stat.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #include "gfclient.h"
 #include "gfclient-student.h"
 #include "workload.h"
 #include "pthread.h"
 #include "steque.h"
+#include "log.h"
 
 #define USAGE                                                                 \
 "usage:\n"                                                                    \
 "  webclient [options]\n"                                                     \
 "options:\n"                                                                  \
 "  -h                  Show this help message\n"                              \
+"  -l [latency_file]   Write the time of each download in microseconds, one\n" \
+"                      per line, to this file\n"                               \
 "  -n [num_requests]   Requests download per thread (Default: 4)\n"           \
 "  -p [server_port]    Server port (Default: 12041)\n"                         \
-"  -s [server_addr]    Server address (Default: 127.0.0.1)\n"                   \
+"  -s [server_addr]    Server address (Default: 127.0.0.1), or a comma\n"     \
+"                      separated list of host[:port] to balance across,\n"     \
+"                      IPv6 addresses with a port as [address]:port\n"         \
 "  -t [nthreads]       Number of threads (Default 32)\n"                       \
 "  -w [workload_path]  Path to workload file (Default: workload.txt)\n"       \
 
+/* Room for the request path plus the "-%06d" counter suffix */
+#define LOCAL_PATH_LEN (PATH_MAX + 16)
+
+/* A file download handed from the boss to the worker threads */
+typedef struct downloadTask {
+  char *path;   /// request path from the workload
+  FILE *file;   /// local file the body is written to
+} downloadTask;
+
+/* A server the downloads are spread across */
+typedef struct endpoint {
+  char *server;
+  unsigned short port;
+  int outstanding;  /// requests in flight to this server, updated atomically
+} endpoint;
+
 /* Global variables ================================================== */
 steque_t taskQueue;
-steque_t threadPool;
+pthread_t *threadPool;
+int threadPoolSize;
 pthread_mutex_t mutex_tq = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t  tq_nonEmpty = PTHREAD_COND_INITIALIZER;
+endpoint *endpoints;
+int nEndpoints;
+double *latencies;  /// seconds each download took, retries included, when -l is given
+int nLatencies;
 
 /* OPTIONS DESCRIPTOR ====================================================== */
 static struct option gLongOptions[] = {
   {"help",          no_argument,            NULL,           'h'},
+  {"latency-file",  required_argument,      NULL,           'l'},
   {"nthreads",      required_argument,      NULL,           't'},
   {"nrequests",     required_argument,      NULL,           'n'},
   {"server",        required_argument,      NULL,           's'},
@@ -51,7 +81,7 @@ static void Usage() {
 static void localPath(char *req_path, char *local_path){
   static int counter = 0;
 
-  sprintf(local_path, "%s-%06d", &req_path[1], counter++);
+  snprintf(local_path, LOCAL_PATH_LEN, "%s-%06d", &req_path[1], counter++);
 }
 
 static FILE* openFile(char *path){
@@ -90,10 +120,181 @@ static void writecb(void* data, size_t data_len, void *arg){
 }
 
 
+/* Server selection ================================================= */
+/* Parses the port after host: in entry, exits on anything but a number from 1 to 65535 */
+static unsigned short parsePort(const char *port, const char *entry){
+  char *end;
+  long value;
+
+  errno = 0;
+  value = strtol(port, &end, 10);
+  if (errno != 0 || end == port || *end != '\0' || value < 1 || value > 65535) {
+    fprintf(stderr, "Bad port in server address %s.\n", entry);
+    exit(EXIT_FAILURE);
+  }
+  return (unsigned short) value;
+}
+
+/* Parses a comma separated list of host[:port], hosts without a port use default_port.
+   An IPv6 address takes a port as [address]:port, a bare address has more than one
+   colon and is taken whole. */
+static void parseEndpoints(char *servers, unsigned short default_port){
+  char *list = strdup(servers);
+  char *entry, *host, *colon, *saveptr;
+
+  endpoints = (endpoint*) malloc((strlen(list) / 2 + 1) * sizeof(endpoint));  // at most one per two characters
+  nEndpoints = 0;
+
+  for (entry = strtok_r(list, ",", &saveptr); entry != NULL; entry = strtok_r(NULL, ",", &saveptr)) {
+    host = entry;
+    colon = NULL;
+    if (entry[0] == '[') {  // [address] or [address]:port
+      char *close = strchr(entry, ']');
+      if (close == NULL || (close[1] != '\0' && close[1] != ':')) {
+        fprintf(stderr, "Bad server address %s.\n", entry);
+        exit(EXIT_FAILURE);
+      }
+      *close = '\0';
+      host = entry + 1;
+      colon = (close[1] == ':') ? close + 1 : NULL;
+    } else if (NULL != (colon = strchr(entry, ':')) && NULL != strchr(colon + 1, ':')) {
+      colon = NULL;  // more than one colon, a bare IPv6 address
+    }
+
+    endpoints[nEndpoints].port = default_port;
+    if (colon != NULL) {
+      *colon = '\0';
+      endpoints[nEndpoints].port = parsePort(colon + 1, servers);
+    }
+    if (*host == '\0') {
+      fprintf(stderr, "Empty host in server address %s.\n", servers);
+      exit(EXIT_FAILURE);
+    }
+    endpoints[nEndpoints].server = host;  // points into list, which is kept for the life of the process
+    endpoints[nEndpoints].outstanding = 0;
+    nEndpoints++;
+  }
+
+  if (nEndpoints == 0) {
+    fprintf(stderr, "No server address given.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Picks uniformly at random one of the remaining servers not marked in tried */
+static int sampleEndpoint(unsigned int *seed, const char *tried, int remaining){
+  int i, k;
+
+  /* While most are untried, redrawing takes fewer than two draws on average */
+  if (remaining * 2 > nEndpoints) {
+    do {
+      i = rand_r(seed) % nEndpoints;
+    } while (tried[i]);
+    return i;
+  }
+
+  /* Only a few are left, take the k-th untried one */
+  k = rand_r(seed) % remaining;
+  for (i = 0; tried[i] || k-- > 0; i++);
+  return i;
+}
+
+/* Power of two choices: of two random untried servers take the one with fewer requests in flight */
+static int pickEndpoint(unsigned int *seed, const char *tried, int remaining){
+  int a, b;
+
+  if (remaining == 1)
+    return sampleEndpoint(seed, tried, remaining);
+
+  a = sampleEndpoint(seed, tried, remaining);
+  b = sampleEndpoint(seed, tried, remaining);
+
+  return (__atomic_load_n(&endpoints[b].outstanding, __ATOMIC_RELAXED) <
+          __atomic_load_n(&endpoints[a].outstanding, __ATOMIC_RELAXED)) ? b : a;
+}
+
+/* Downloads one file, retrying on a server not tried yet when the transfer fails.
+   tried has room for one flag per server. */
+static void downloadFile(downloadTask *task, unsigned int *seed, char *tried){
+  gfcrequest_t *gfr = NULL;
+  gfstatus_t status;
+  int i, rc;
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  memset(tried, 0, nEndpoints);
+  for (int attempt = 0; attempt < nEndpoints; attempt++) {
+    i = pickEndpoint(seed, tried, nEndpoints - attempt);
+
+    gfr = gfc_create();
+    gfc_set_server(gfr, endpoints[i].server);
+    gfc_set_path(gfr, task->path);
+    gfc_set_port(gfr, endpoints[i].port);
+    gfc_set_writefunc(gfr, writecb);
+    gfc_set_writearg(gfr, task->file);
+
+    L(INFO, "Requesting %s%s", endpoints[i].server, task->path);
+
+    __sync_fetch_and_add(&endpoints[i].outstanding, 1);
+    rc = gfc_perform(gfr);
+    __sync_fetch_and_sub(&endpoints[i].outstanding, 1);
+
+    status = gfc_get_status(gfr);
+    gfc_cleanup(gfr);
+
+    if (rc >= 0 && status != GF_ERROR && status != GF_INVALID)
+      break;
+
+    // Throw away the partial body before trying the next server
+    fflush(task->file);
+    if (0 > ftruncate(fileno(task->file), 0))
+      perror("Unable to truncate file");
+    rewind(task->file);
+    tried[i] = 1;
+  }
+
+  fclose(task->file);
+
+  if (latencies) {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    latencies[__sync_fetch_and_add(&nLatencies, 1)] =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  }
+}
+
+/* Writes the download times in microseconds, one per line, in completion order */
+static void writeLatencies(const char *filename){
+  FILE *out;
+
+  if (NULL == (out = fopen(filename, "w"))) {
+    perror(filename);
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < nLatencies; i++)
+    fprintf(out, "%.0f\n", latencies[i] * 1e6);
+  if (0 != fclose(out)) {
+    perror(filename);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Prints the CPU time and peak RSS of the whole client */
+static void printResourceUsage(){
+  struct rusage ru;
+
+  if (0 > getrusage(RUSAGE_SELF, &ru))
+    return;
+  fprintf(stdout, "CPU: user %.3fs, sys %.3fs, max RSS %ld KB\n",
+    ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6, ru.ru_maxrss);
+}
+
 /* Download request handler, worker threads starts execution from here */
 void* getFileHandler(void* nrequests)
 {
-	gfcrequest_t* req = NULL;
+	downloadTask* req = NULL;
+	unsigned int seed = (unsigned int)pthread_self();  // per thread state for rand_r()
+	char *tried = (char*)malloc(nEndpoints);  // servers already tried for the current download
 
 	// Loop until this handler has processed [nrequests] requests
   int numReqHandled = 0;
@@ -105,40 +306,39 @@ void* getFileHandler(void* nrequests)
       pthread_cond_wait(&tq_nonEmpty, &mutex_tq);
     }
 
-		req = (gfcrequest_t*)steque_pop(&taskQueue);  // Retrieve a task
+		req = (downloadTask*)steque_pop(&taskQueue);  // Retrieve a task
 		pthread_mutex_unlock(&mutex_tq);
     
     if(req) {  
       // Perform this download request 
-		  gfc_perform(req);
-		  gfc_cleanup(req);
+		  downloadFile(req, &seed, tried);
       req = NULL;
       numReqHandled++;
     }
 	}
 
+	free(tried);
 	pthread_exit(NULL);  // Exit the current thread.
 }
 
 /* Create worker thread pool  =========================================*/
 void createWorkerThreads(int nThreads, long nrequests) {
-	steque_init(&threadPool);
+	threadPool = (pthread_t*)malloc(nThreads * sizeof(pthread_t));  // one allocation for the whole pool, freed on join
+	threadPoolSize = nThreads;
 
 	for (int i = 0; i < nThreads; i++) {
-		pthread_t* tid = (pthread_t*)malloc(sizeof(pthread_t));  // must be freed later 
-		pthread_create(tid, NULL, &getFileHandler, (void *)nrequests);  // should be joinable
-		steque_enqueue(&threadPool, (steque_item)tid);
-    fprintf(stdout, "Created thread %d \n", i);  // DEBUG_PRINT
+		pthread_create(&threadPool[i], NULL, &getFileHandler, (void *)nrequests);  // should be joinable
+    L(DEBUG, "Created thread %d", i);
 	}
 }
 
 /* Join worker threads  ==============================================*/
 void joinWorkerThreads() {
-	while (!steque_isempty(&threadPool)) {
-		pthread_t * tid = (pthread_t *)steque_pop(&threadPool);
-		pthread_join(*tid, NULL);
-    free(tid);  // must free pointer to this tid object
+	for (int i = 0; i < threadPoolSize; i++) {
+		pthread_join(threadPool[i], NULL);
 	}
+	free(threadPool);
+	threadPool = NULL;
 }
 
 /* Main ========================================================= */
@@ -147,26 +347,27 @@ int main(int argc, char **argv) {
   char *server = "localhost";
   unsigned short port = 12041;
   char *workload_path = "workload.txt";
+  char *latency_path = NULL;
 
   int i = 0;
   int option_char = 0;
   long nrequests = 4;
   int nthreads = 32;
   //int returncode = 0;
-  gfcrequest_t *gfr = NULL;
-  FILE *file = NULL;
+  downloadTask *tasks = NULL;
   char *req_path = NULL;
-  char local_path[1033];
-
-  setbuf(stdout, NULL); // disable caching
+  char local_path[LOCAL_PATH_LEN];
 
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "t:hn:xp:s:w:", gLongOptions, NULL)) != -1) {
+  while ((option_char = getopt_long(argc, argv, "t:hl:n:xp:s:w:", gLongOptions, NULL)) != -1) {
     switch (option_char) {
       case 'h': // help
         Usage();
         exit(0);
         break;                      
+      case 'l': // latency-file
+        latency_path = optarg;
+        break;
       case 'n': // nrequests
         nrequests = atoi(optarg);
         break;
@@ -188,54 +389,64 @@ int main(int argc, char **argv) {
     }
   }
 
+  // The per request lines are the client's output, they stay on stdout as before the logger
+  log_set_file(stdout);
+
   if( EXIT_SUCCESS != workload_init(workload_path)){
     fprintf(stderr, "Unable to load workload file %s.\n", workload_path);
     exit(EXIT_FAILURE);
   }
 
+  parseEndpoints(server, port);
+
   gfc_global_init();
 
   // Initialize task queue
   steque_init(&taskQueue);
 
+  // One slot per download, filled in by the workers as they finish
+  if (latency_path)
+    latencies = (double*) malloc(nrequests * nthreads * sizeof(double));
+
   // Initialized worker thread pool
   createWorkerThreads(nthreads, nrequests);
 
   /*Making the requests...*/
+  tasks = (downloadTask*) malloc(nrequests * nthreads * sizeof(downloadTask));
   for(i = 0; i < nrequests * nthreads; i++){
     req_path = workload_get_path();
 
-    if(strlen(req_path) > 500){
-      fprintf(stderr, "Request path exceeded maximum of 500 characters\n.");
+    if(strlen(req_path) >= PATH_MAX){
+      fprintf(stderr, "Request path exceeded maximum of %d characters.\n", PATH_MAX - 1);
       exit(EXIT_FAILURE);
     }
 
     localPath(req_path, local_path);
 
-    file = openFile(local_path);
-
-    gfr = gfc_create();
-    gfc_set_server(gfr, server);
-    gfc_set_path(gfr, req_path);
-    gfc_set_port(gfr, port);
-    gfc_set_writefunc(gfr, writecb);
-    gfc_set_writearg(gfr, file);
-
-    fprintf(stdout, "Requesting %s%s\n", server, req_path);
+    tasks[i].path = req_path;
+    tasks[i].file = openFile(local_path);
 
 	  // Enqueue the file download request to the task queue, it's up to the 
-    // worker threads to process the requests and clean up the gfr memory.
+    // worker threads to pick a server and perform the request.
 	  pthread_mutex_lock(&mutex_tq);
-	  steque_enqueue(&taskQueue, (steque_item)gfr);  // enqueue request
+	  steque_enqueue(&taskQueue, (steque_item)&tasks[i]);  // enqueue request
 	  pthread_mutex_unlock(&mutex_tq);
     pthread_cond_broadcast(&tq_nonEmpty);  // signal all the workers
   }
 
   // wait for all the worker threads join before exit
   joinWorkerThreads();  
+  free(tasks);
+
+  if (latency_path) {
+    writeLatencies(latency_path);
+    free(latencies);
+  }
 
   gfc_global_cleanup();
 
+  printResourceUsage();
+
   return 0;
 }  
 
@@ -7,22 +7,37 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <assert.h>
+#include <time.h>
+#include <limits.h>
 
 #include "gfserver.h"
 #include "gfserver-student.h"
 #include "content.h"
 #include <pthread.h>
 #include "steque.h"
+#include "log.h"
 
-#define BUFFER_SIZE 12041
 #define MIN(a, b) ((a < b) ? a : b)
 
+#define CHUNK_MIN (64 * 1024)        // first chunk of a transfer, a multiple of the page size
+#define CHUNK_MAX (2 * 1024 * 1024)  // chunks double up to this while the transfer goes on
+#define LARGE_BUFFERS 16             // CHUNK_MAX send buffers shared by the workers, 32 MiB in all
+
+#define PREFETCH_WINDOW (4 * 1024 * 1024)        // bytes advised ahead of a queued or running transfer
+#define PREFETCH_MAX_WINDOW (32 * 1024 * 1024)   // readahead window of a long transfer grows up to this
+#define PREFETCH_MAX_BUDGET (256 * 1024 * 1024)  // cap on bytes advised for requests still in the queue
+#define PREFETCH_MAX_JOBS 64                     // files waiting for the prefetch thread
+
+#define NSEC_PER_SEC 1000000000LL
+#define RATE_BURST_NS (NSEC_PER_SEC / 10)  // a rate limited sender may burst 100ms worth of bytes
+
+// Token bucket in debt form: sending always takes the tokens, a negative balance is the time to wait.
+typedef struct tokenBucket {
+	double rate;        /// bytes per second, 0 means unlimited
+	double tokens;      /// bytes that may be sent right now, negative when in debt
+	long long last;     /// time of the last refill in ns
+} tokenBucket;
 
-// Global variables
-steque_t requestQueue;
-steque_t threadPool;
-pthread_mutex_t mutex_rq = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t rq_nonEmpty = PTHREAD_COND_INITIALIZER;
 
 // Defines eveything a worker thread should know to process a connection
 typedef struct request { 
@@ -30,9 +45,43 @@ typedef struct request {
 	gfstatus_t status;   /// status - used by worker thread to transfer header
 	size_t fileLen;      /// file length - used by worker thread to transfer header
     const char * path;   /// file path - used by worker thread to parse the request string
+	size_t prefetched;   /// bytes handed to the prefetch thread, counted against the prefetch budget
 	void* arg;           /// Additional arg that user passed in.
+	struct request *next;  /// link in the free request list
 } request;
 
+// Global variables
+steque_t requestQueue;
+pthread_t *threadPool;
+pthread_mutex_t mutex_rq = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t rq_nonEmpty = PTHREAD_COND_INITIALIZER;
+request *freeRequests = NULL;  // finished requests kept for reuse, guarded by mutex_rq
+int requestAllocs = 0;         // requests malloc'd so far, guarded by mutex_rq
+size_t prefetchBudget = 0;     // set from available memory in initRequestQueue()
+size_t prefetchInFlight = 0;   // bytes advised for queued requests, guarded by mutex_rq
+
+// Paths the prefetch thread still has to advise, copied because the request may be served
+// and its path freed first. A ring guarded by mutex_rq.
+char prefetchPaths[PREFETCH_MAX_JOBS][PATH_MAX];
+int prefetchHead = 0;
+int prefetchCount = 0;
+pthread_cond_t pq_nonEmpty = PTHREAD_COND_INITIALIZER;
+pthread_t prefetchThread;
+
+// Rate limits, a connection is held to its own bucket and to the server wide bucket it is part of.
+double connectionRate = 0;     // bytes per second per connection, 0 means unlimited
+tokenBucket serverBucket;      // shared by all connections, guarded by mutex_sb
+pthread_mutex_t mutex_sb = PTHREAD_MUTEX_INITIALIZER;
+long long connectionThrottledNs = 0;  // time transfers slept on their connection limit
+long long serverThrottledNs = 0;      // time transfers slept on the server wide limit
+
+// Each worker owns a CHUNK_MIN send buffer. A transfer that grows its chunks past that borrows a CHUNK_MAX
+// buffer from a pool shared by all workers for as long as it runs, and keeps CHUNK_MIN chunks when none is left.
+char *freeLargeBuffers[LARGE_BUFFERS];  // returned large buffers, guarded by mutex_lb
+int nFreeLargeBuffers = 0;
+int largeBufferAllocs = 0;              // large buffers allocated so far, guarded by mutex_lb
+pthread_mutex_t mutex_lb = PTHREAD_MUTEX_INITIALIZER;
+
 
 size_t getFileLength(int fd) {
 	if(fd < 0) {
@@ -44,6 +93,53 @@ size_t getFileLength(int fd) {
 	return st.st_size;
 }  
 
+static long long nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void bucketInit(tokenBucket *b, double rate) {
+	b->rate = rate;
+	b->tokens = rate * RATE_BURST_NS / NSEC_PER_SEC;
+	b->last = nowNs();
+}
+
+// Takes n bytes from the bucket and returns how long the caller must sleep before sending them.
+static long long bucketTake(tokenBucket *b, size_t n) {
+	if (b->rate <= 0) {
+		return 0;
+	}
+	long long now = nowNs();
+	double burst = b->rate * RATE_BURST_NS / NSEC_PER_SEC;
+	b->tokens = MIN(burst, b->tokens + b->rate * (now - b->last) / NSEC_PER_SEC);
+	b->last = now;
+	b->tokens -= n;
+
+	return (b->tokens >= 0) ? 0 : (long long)(-b->tokens * NSEC_PER_SEC / b->rate);
+}
+
+// Sleeps (never spins) until n more bytes of this connection may be sent under both limits.
+static void throttle(tokenBucket *conn, size_t n) {
+	long long connWait = bucketTake(conn, n);
+	long long serverWait = 0;
+
+	if (serverBucket.rate > 0) {
+		pthread_mutex_lock(&mutex_sb);
+		serverWait = bucketTake(&serverBucket, n);
+		pthread_mutex_unlock(&mutex_sb);
+	}
+
+	long long wait = (connWait > serverWait) ? connWait : serverWait;
+	if (wait <= 0) {
+		return;
+	}
+	__sync_fetch_and_add((connWait > serverWait) ? &connectionThrottledNs : &serverThrottledNs, wait);
+
+	struct timespec ts = { wait / NSEC_PER_SEC, wait % NSEC_PER_SEC };
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
 //
 //  The purpose of this function is to handle a get request
 //
@@ -54,57 +150,223 @@ size_t getFileLength(int fd) {
 //        not in others.
 //
 ssize_t gfs_handler(gfcontext_t *ctx, const char *path, void* arg){	
-	request *req = (request *)malloc(sizeof(request));  // must allocate request on the heap, so that worker threads can get to it.
+	request *req = NULL;
+	int prefetch = 0;
+
+	pthread_mutex_lock(&mutex_rq);
+	// Reuse a finished request if there is one, only grow the pool when all are in flight.
+	if (freeRequests) {
+		req = freeRequests;
+		freeRequests = req->next;
+	} else {
+		req = (request *)malloc(sizeof(request));  // must allocate request on the heap, so that worker threads can get to it.
+		requestAllocs++;
+	}
 	req->ctx = ctx;
 	req->path = path;
+	req->prefetched = 0;
+
+	// Only prefetch while the queued requests fit in the budget, otherwise the pages may be evicted before use.
+	// This runs on the accept thread, so the lookup and the fadvise, which may wait on the disk, are left
+	// to the prefetch thread.
+	if (prefetchInFlight + PREFETCH_WINDOW <= prefetchBudget && prefetchCount < PREFETCH_MAX_JOBS) {
+		snprintf(prefetchPaths[(prefetchHead + prefetchCount) % PREFETCH_MAX_JOBS], PATH_MAX, "%s", path);
+		prefetchCount++;
+		req->prefetched = PREFETCH_WINDOW;
+		prefetchInFlight += PREFETCH_WINDOW;
+		prefetch = 1;
+	}
 
 	// Enqueue the transfer request.
-	pthread_mutex_lock(&mutex_rq);
 	steque_enqueue(&requestQueue, (steque_item)req);
 	pthread_mutex_unlock(&mutex_rq);
 	pthread_cond_broadcast(&rq_nonEmpty);  // Signal all the worker threads
+	if (prefetch) {
+		pthread_cond_signal(&pq_nonEmpty);
+	}
 
 	return 0;
 }
 
+// Prefetch thread, starts the disk read of the first window of each queued file
+void* prefetchHandler(void* arg) {
+	char path[PATH_MAX];
+
+	while (1) {
+		pthread_mutex_lock(&mutex_rq);
+		while (prefetchCount == 0) {
+			pthread_cond_wait(&pq_nonEmpty, &mutex_rq);
+		}
+		strcpy(path, prefetchPaths[prefetchHead]);
+		prefetchHead = (prefetchHead + 1) % PREFETCH_MAX_JOBS;
+		prefetchCount--;
+		pthread_mutex_unlock(&mutex_rq);
+
+		int fd = content_open(path);
+		size_t fileLen = getFileLength(fd);
+		if (fileLen > 0) {
+			posix_fadvise(fd, 0, MIN(fileLen, PREFETCH_WINDOW), POSIX_FADV_WILLNEED);
+		}
+		if (fd >= 0) {
+			close(fd);  // the advice is on the file's pages, not on this fd
+		}
+	}
+}
+
+// Borrows a CHUNK_MAX send buffer from the pool, allocating one if the pool has not reached LARGE_BUFFERS.
+// Returns NULL when all are in use.
+static char *takeLargeBuffer(size_t pageSize) {
+	char *buff = NULL;
+
+	pthread_mutex_lock(&mutex_lb);
+	if (nFreeLargeBuffers > 0) {
+		buff = freeLargeBuffers[--nFreeLargeBuffers];
+	} else if (largeBufferAllocs < LARGE_BUFFERS && posix_memalign((void **)&buff, pageSize, CHUNK_MAX) == 0) {
+		largeBufferAllocs++;
+	}
+	pthread_mutex_unlock(&mutex_lb);
+	return buff;
+}
+
+// Returns a buffer taken with takeLargeBuffer() to the pool.
+static void releaseLargeBuffer(char *buff) {
+	pthread_mutex_lock(&mutex_lb);
+	freeLargeBuffers[nFreeLargeBuffers++] = buff;
+	pthread_mutex_unlock(&mutex_lb);
+}
+
+// Largest chunk a transfer may send at once: CHUNK_MAX, or under a rate limit the smallest
+// burst in whole pages, so a single chunk never overdraws a bucket by more than one burst.
+static size_t chunkLimit(size_t pageSize) {
+	size_t limit = CHUNK_MAX;
+	double rates[] = { connectionRate, serverBucket.rate };
+
+	for (int i = 0; i < 2; i++) {
+		if (rates[i] > 0) {
+			size_t burst = (size_t)(rates[i] * RATE_BURST_NS / NSEC_PER_SEC) / pageSize * pageSize;
+			if (burst < pageSize) {
+				burst = pageSize;
+			}
+			limit = MIN(limit, burst);
+		}
+	}
+	return limit;
+}
+
 
 // Worker thread which handles file transfer requests
 void* transferHandler(void* arg) {
+	request *done = NULL;  // request finished in the previous cycle
+	char *sendBuff = NULL;  // page aligned, allocated once and reused for the first chunks of every transfer
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	size_t chunkMax = chunkLimit(pageSize);  // setTransferRates runs before the workers start
+
+	if (posix_memalign((void **)&sendBuff, pageSize, CHUNK_MIN) != 0) {
+		fprintf(stderr, "Unable to allocate send buffer.\n");
+		exit(EXIT_FAILURE);
+	}
+
 	// Loops forever, each loop cycle handles a file transfer request
 	while (1) { 
 		request *req = NULL;
 
 		// Get a request from the queue
 		pthread_mutex_lock(&mutex_rq);
+		if (done) {  // hand the previous request back to the pool while we hold the lock anyway
+			done->next = freeRequests;
+			freeRequests = done;
+			done = NULL;
+		}
 		while (steque_isempty(&requestQueue)) {  // must use while loop since multiple threads competes to get the mutex
 			pthread_cond_wait(&rq_nonEmpty, &mutex_rq);
 		}
 		req = (request *)steque_pop(&requestQueue);
+		prefetchInFlight -= req->prefetched;
 		pthread_mutex_unlock(&mutex_rq);
 
         if(req) {
-            int fd = content_get(req->path);
-	        req->status = (fd == -1) ? GF_FILE_NOT_FOUND : GF_OK;
+            // Each transfer opens its own fd and closes it when done, so the open files are
+            // bounded by the number of workers however many files the content has.
+            int fd = content_open(req->path);
+            if (fd >= 0) {
+                req->status = GF_OK;
+            } else if (errno == ENOENT) {
+                req->status = GF_FILE_NOT_FOUND;
+            } else {  // the file exists but can't be opened now, e.g. out of fds, don't claim it is missing
+                L(ERROR, "Unable to open %s: %s", req->path, strerror(errno));
+                req->status = GF_ERROR;
+            }
 	        req->fileLen = getFileLength(fd);
 
-            // Always send the header, fileLen will be 0 if file not found
+            L(DEBUG, "Sending %s, status %d, %zu bytes", req->path, req->status, req->fileLen);
+
+            // Always send the header, fileLen will be 0 if the file is not sent
 		    gfs_sendheader(req->ctx, req->status, req->fileLen);  
 
 		    // Send the file if OK
-			if (req->status == GF_OK && fd > 0) {  
-			    char sendBuff[BUFFER_SIZE];
-				int bytesSent = 0;
-				int totalSent = 0;
+			if (req->status == GF_OK) {  
+				ssize_t bytesRead = 0;
+				ssize_t bytesSent = 0;
+				size_t totalSent = 0;
+				// Small files go in one chunk, larger ones start small so the first bytes leave early
+				// and then grow so a long transfer takes few syscalls per megabyte.
+				size_t chunk = MIN(MIN(req->fileLen, CHUNK_MIN), chunkMax);
+				char *buff = sendBuff;  // swapped for a large buffer once the chunks outgrow it
+				size_t buffSize = CHUNK_MIN;
+				int askedPool = 0;
+				size_t window = PREFETCH_WINDOW;
+				// File offset the page cache has been (or is being) advised up to. A file sent in a single
+				// chunk is read by that one pread, advising it first would only add a syscall.
+				size_t ahead = (req->fileLen > chunk) ? req->prefetched : req->fileLen;
+				tokenBucket connBucket;
+				bucketInit(&connBucket, connectionRate);
+				if (req->fileLen > PREFETCH_WINDOW) {
+					posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+				}
 			    while (totalSent < req->fileLen) {
-				    memset(sendBuff, 0, sizeof(sendBuff));
-				    pread(fd, sendBuff, sizeof(sendBuff), totalSent);  // Must use pread() to be thread safe
-				    bytesSent = gfs_send(req->ctx, sendBuff, MIN(sizeof(sendBuff), (req->fileLen - totalSent)));
+					// Keep the next window in flight once the reader is half way through the current one,
+					// doubling it like the kernel readahead does for a stream that stays sequential.
+					if (ahead < req->fileLen && totalSent + window / 2 >= ahead) {
+						posix_fadvise(fd, ahead, window, POSIX_FADV_WILLNEED);
+						ahead += window;
+						window = MIN(window * 2, PREFETCH_MAX_WINDOW);
+					}
+				    bytesRead = pread(fd, buff, MIN(chunk, (req->fileLen - totalSent)), totalSent);  // Must use pread() to be thread safe
+				    if (bytesRead <= 0) {  // file shrank or read failed, the client can't get fileLen bytes
+					    gfs_abort(req->ctx);
+					    break;
+				    }
+				    throttle(&connBucket, bytesRead);
+				    if ((bytesSent = gfs_send(req->ctx, buff, bytesRead)) < 0) {
+					    break;  // connection is gone
+				    }
 				    totalSent += bytesSent;
+				    // Only grow while more than the current chunk is left to send
+				    if (chunk < chunkMax && req->fileLen - totalSent > chunk) {
+					    size_t next = MIN(chunk * 2, chunkMax);
+					    char *large;
+					    if (next > buffSize && !askedPool) {
+						    askedPool = 1;  // one try per transfer, a busy pool stays busy for a while
+						    if (NULL != (large = takeLargeBuffer(pageSize))) {
+							    buff = large;
+							    buffSize = CHUNK_MAX;
+						    }
+					    }
+					    if (next <= buffSize) {
+						    chunk = next;
+					    }
+				    }
+			    }
+			    if (buff != sendBuff) {
+				    releaseLargeBuffer(buff);
 			    }
 		    }
+		    if (fd >= 0) {
+			    close(fd);
+		    }
 		
-		    // Clean up the request memory allocated by the boss thread
-		    free(req);
+		    // Return the request to the pool on the next trip through the queue lock
+		    done = req;
 		    req = NULL;
 		}
 	}
@@ -112,18 +374,44 @@ void* transferHandler(void* arg) {
 
 // Create worker thread pool with passed in number of threads.
 void createWorkerThreads(int nthreads) {
-	steque_init(&threadPool);
+	threadPool = (pthread_t *)malloc(nthreads * sizeof(pthread_t));  // one allocation for the whole pool
 
 	for (int i = 0; i < nthreads; i++) {
-		pthread_t *tid = (pthread_t *)malloc(sizeof(pthread_t));  // must be freed later 
-		pthread_create(tid, NULL, &transferHandler, NULL); 
-		pthread_detach(*tid);
-		steque_enqueue(&threadPool, (steque_item)tid);
+		pthread_create(&threadPool[i], NULL, &transferHandler, NULL); 
+		pthread_detach(threadPool[i]);
 	}
+
+	pthread_create(&prefetchThread, NULL, &prefetchHandler, NULL);
+	pthread_detach(prefetchThread);
+}
+
+// Set the per connection and server wide send rates in bytes per second, 0 leaves a limit off.
+void setTransferRates(size_t perConnection, size_t perServer) {
+	connectionRate = perConnection;
+	bucketInit(&serverBucket, perServer);
+}
+
+// Print how long transfers have been held back by each rate limit.
+void printThrottleStats() {
+	fprintf(stdout, "Throttled: connection limit %.3fs, server limit %.3fs\n",
+		(double)connectionThrottledNs / NSEC_PER_SEC, (double)serverThrottledNs / NSEC_PER_SEC);
+}
+
+// Print how many requests and queue nodes were ever allocated, both stop growing
+// once the pools cover the peak number of requests in flight.
+// Runs at exit, possibly from the signal handler, so it must not take mutex_rq.
+void printPoolStats() {
+	fprintf(stdout, "Allocated: %d requests, %d queue nodes, %d large send buffers\n",
+		__atomic_load_n(&requestAllocs, __ATOMIC_RELAXED), __atomic_load_n(&requestQueue.nalloc, __ATOMIC_RELAXED),
+		__atomic_load_n(&largeBufferAllocs, __ATOMIC_RELAXED));
 }
 
 // Initialze a request queue
 void initRequestQueue() {
 	steque_init(&requestQueue);
+
+	// Allow queued prefetches to use up to an eighth of the currently free memory.
+	size_t avail = (size_t)sysconf(_SC_AVPHYS_PAGES) * (size_t)sysconf(_SC_PAGESIZE);
+	prefetchBudget = MIN(avail / 8, PREFETCH_MAX_BUDGET);
 }
 
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+
+#include "log.h"
+
+#define LOG_RING_SIZE (64 * 1024)                  /* bytes buffered per thread */
+#define LOG_LINE_MAX (PATH_MAX + 256)              /* fits a full path, longer lines are truncated */
+#define LOG_FLUSH_INTERVAL_NS (50 * 1000 * 1000)   /* how often the flusher drains */
+
+/*
+ * A single producer, single consumer byte ring.  Only the owning thread
+ * advances head and only a flush advances tail, so neither needs a lock.
+ */
+typedef struct logRing{
+  char buf[LOG_RING_SIZE];
+  size_t head;            /* bytes written into the ring */
+  size_t tail;            /* bytes written out of the ring */
+  int inUse;              /* 0 once the owner exited, the ring may be claimed */
+  struct logRing *next;   /* set before the ring is published, never changed */
+} logRing;
+
+static logRing *gRings = NULL;
+static __thread logRing *tRing = NULL;
+static pthread_once_t gLogOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t gRingKey;
+static pthread_mutex_t gRingsMutex = PTHREAD_MUTEX_INITIALIZER;  /* serializes publishing */
+static pthread_mutex_t gFlushMutex;  /* recursive, so exit() on the flusher thread can flush */
+static int gLogFd = -1;              /* set by log_set_file, MYLOG_FILE until then */
+
+static int _log_fd(){
+  return (gLogFd >= 0) ? gLogFd : fileno(MYLOG_FILE);
+}
+
+static void _ring_release(void *ring){
+  __atomic_store_n(&((logRing*) ring)->inUse, 0, __ATOMIC_RELEASE);
+}
+
+/* Writes out what is in the ring, the caller holds gFlushMutex */
+static void _ring_drain(logRing *ring){
+  size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  size_t tail = ring->tail;
+  size_t off, len;
+  ssize_t n;
+
+  while(tail < head){
+    off = tail % LOG_RING_SIZE;
+    len = head - tail;
+    if(len > LOG_RING_SIZE - off)
+      len = LOG_RING_SIZE - off;
+
+    if(0 > (n = write(_log_fd(), &ring->buf[off], len))){
+      if(errno == EINTR)
+        continue;
+      tail = head;  /* nowhere to write to, drop the output */
+      break;
+    }
+    tail += n;
+  }
+
+  __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+void log_set_file(FILE *file){
+  gLogFd = fileno(file);
+}
+
+void log_flush(){
+  logRing *ring;
+
+  pthread_mutex_lock(&gFlushMutex);
+  for(ring = __atomic_load_n(&gRings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    _ring_drain(ring);
+  pthread_mutex_unlock(&gFlushMutex);
+}
+
+static void* _flusher(void *arg){
+  struct timespec interval = { 0, LOG_FLUSH_INTERVAL_NS };
+
+  while(1){
+    nanosleep(&interval, NULL);
+    log_flush();
+  }
+
+  return NULL;
+}
+
+static void _log_start(){
+  pthread_mutexattr_t attr;
+  pthread_t tid;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&gFlushMutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  pthread_key_create(&gRingKey, _ring_release);
+  atexit(log_flush);
+
+  pthread_create(&tid, NULL, _flusher, NULL);
+  pthread_detach(tid);
+}
+
+/* Returns the calling thread's ring, claiming a released one or publishing a new one */
+static logRing* _ring_get(){
+  logRing *ring;
+  int unused;
+
+  if(tRing != NULL)
+    return tRing;
+
+  pthread_once(&gLogOnce, _log_start);
+
+  for(ring = __atomic_load_n(&gRings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next){
+    unused = 0;
+    if(__atomic_compare_exchange_n(&ring->inUse, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+
+  if(ring == NULL){
+    ring = (logRing*) malloc(sizeof(logRing));
+    ring->head = 0;
+    ring->tail = 0;
+    ring->inUse = 1;
+
+    pthread_mutex_lock(&gRingsMutex);
+    ring->next = gRings;
+    __atomic_store_n(&gRings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&gRingsMutex);
+  }
+
+  pthread_setspecific(gRingKey, ring);
+  tRing = ring;
+  return ring;
+}
+
+void log_write(const char *format, ...){
+  logRing *ring = _ring_get();
+  char line[LOG_LINE_MAX];
+  size_t head, off, len;
+  va_list args;
+  int n;
+
+  va_start(args, format);
+  n = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+
+  if(n < 0)
+    return;
+  len = n;
+  if(len >= LOG_LINE_MAX){
+    /* Keep the line ending L() appended, or the next line is glued on */
+    len = LOG_LINE_MAX - 1;
+    line[len - 1] = '\n';
+  }
+
+  head = ring->head;
+  if(head + len - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > LOG_RING_SIZE){
+    /* Ring is full, write it and this line out now, keeping the order */
+    pthread_mutex_lock(&gFlushMutex);
+    _ring_drain(ring);
+    if(0 > write(_log_fd(), line, len)){
+      /* nowhere to write to, drop the line */
+    }
+    pthread_mutex_unlock(&gFlushMutex);
+    return;
+  }
+
+  off = head % LOG_RING_SIZE;
+  if(len > LOG_RING_SIZE - off){
+    memcpy(&ring->buf[off], line, LOG_RING_SIZE - off);
+    memcpy(ring->buf, &line[LOG_RING_SIZE - off], len - (LOG_RING_SIZE - off));
+  }
+  else
+    memcpy(&ring->buf[off], line, len);
+
+  __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+}
@@ -10,11 +10,34 @@
 #define TRACE 5
 
 #ifndef MYLOG_PRIORITY
-#define MYLOG_PRIORITY 1
-#endif 
+#define MYLOG_PRIORITY INFO
+#endif
 
 #define MYLOG_FILE stderr
 
-#define L(priority,format,a...) if(priority <= MYLOG_PRIORITY) fprintf(MYLOG_FILE, format "\n", ## a);
+/*
+ * Logs a line at the given priority.  The priority test is a constant
+ * expression, so calls above MYLOG_PRIORITY are compiled out.  The line
+ * is formatted into the calling thread's log buffer and written out
+ * by a background thread, so logging never blocks on the output.
+ */
+#define L(priority,format,a...) do { if(priority <= MYLOG_PRIORITY) log_write(format "\n", ## a); } while(0)
 
-#endif 
+/*
+ * Formats a message into the calling thread's log buffer.  Use L().
+ */
+void log_write(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+/*
+ * Sends the log to file instead of MYLOG_FILE.  Call it before the
+ * first L(), the output is not switched under running threads.
+ */
+void log_set_file(FILE *file);
+
+/*
+ * Writes out everything buffered so far.  Called on exit, it only
+ * needs to be called directly before output must be visible.
+ */
+void log_flush();
+
+#endif
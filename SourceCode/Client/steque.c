@@ -5,13 +5,30 @@
 void steque_init(steque_t *this){
   this->front = NULL;
   this->back = NULL;
+  this->spare = NULL;
   this->N = 0;
+  this->nalloc = 0;
+}
+
+/* Nodes are recycled through the spare list so that a steque in steady
+   state (as many pops as enqueues) never calls malloc or free. */
+static steque_node_t* _steque_node(steque_t* this){
+  steque_node_t* node;
+
+  if(this->spare == NULL){
+    this->nalloc++;
+    return (steque_node_t*) malloc(sizeof(steque_node_t));
+  }
+
+  node = this->spare;
+  this->spare = node->next;
+  return node;
 }
 
 void steque_enqueue(steque_t* this, steque_item item){
   steque_node_t* node;
 
-  node = (steque_node_t*) malloc(sizeof(steque_node_t));
+  node = _steque_node(this);
   node->item = item;
   node->next = NULL;
   
@@ -27,7 +44,7 @@ void steque_enqueue(steque_t* this, steque_item item){
 void steque_push(steque_t* this, steque_item item){
   steque_node_t* node;
 
-  node = (steque_node_t*) malloc(sizeof(steque_node_t));
+  node = _steque_node(this);
   node->item = item;
   node->next = this->front;
 
@@ -61,7 +78,8 @@ steque_item steque_pop(steque_t* this){
 
   this->front = this->front->next;
   if (this->front == NULL) this->back = NULL;
-  free(node);
+  node->next = this->spare;
+  this->spare = node;
 
   this->N--;
 
@@ -89,6 +107,14 @@ steque_item steque_front(steque_t* this){
 }
 
 void steque_destroy(steque_t* this){
+  steque_node_t* node;
+
   while(!steque_isempty(this))
     steque_pop(this);
+
+  while(this->spare != NULL){
+    node = this->spare;
+    this->spare = node->next;
+    free(node);
+  }
 }
@@ -11,7 +11,9 @@ typedef struct steque_node_t{
 typedef struct{
   steque_node_t* front;
   steque_node_t* back;
+  steque_node_t* spare;  /* popped nodes kept for reuse by the next enqueue/push */
   int N;
+  int nalloc;            /* nodes malloc'd so far, stays flat once spare covers the peak size */
 }steque_t;
 
 
@@ -39,7 +41,8 @@ void steque_cycle(steque_t* this);
 /* Returns the element at the "front" of the steque without removing it*/
 steque_item steque_front(steque_t* this);
 
-/* Empties the steque and performs any necessary memory cleanup */
+/* Empties the steque and performs any necessary memory cleanup,
+   including the nodes kept for reuse */
 void steque_destroy(steque_t* this);
 
 #endif
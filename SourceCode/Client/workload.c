@@ -5,16 +5,17 @@
 
 #include "workload.h"
 
-static char *gWorkloadPathArray[100];
-static unsigned short int gUniqueWorkloadPaths = 0;
+static char **gWorkloadPathArray = NULL;
+static unsigned int gUniqueWorkloadPaths = 0;
 
 static pthread_mutex_t counter_mutex;
 static int counter = 0;
 static int mode = WORKLOAD_SEQ;
 
 int workload_init(char *workload_path) {
-  int i = 0;
-  char temp_buf[256];
+  unsigned int i = 0, capacity = 128;
+  char *line = NULL, *token, *ptr;
+  size_t linecap = 0;
 
   FILE *file_handle;
 
@@ -24,8 +25,21 @@ int workload_init(char *workload_path) {
     return EXIT_FAILURE;
   }
 
-  while (fscanf(file_handle, "%s", temp_buf) != EOF)
-    gWorkloadPathArray[i++] = strdup(temp_buf);
+  gWorkloadPathArray = (char **) malloc(capacity * sizeof(char *));
+
+  /* Whitespace separated paths, read through one reused line buffer so
+   * there is no fixed limit on the path length. */
+  while (getline(&line, &linecap, file_handle) != -1)
+    for (token = strtok_r(line, " \t\r\n", &ptr); token != NULL;
+         token = strtok_r(NULL, " \t\r\n", &ptr)) {
+      if (i == capacity) {
+        capacity *= 2;
+        gWorkloadPathArray = (char **) realloc(gWorkloadPathArray, capacity * sizeof(char *));
+      }
+      gWorkloadPathArray[i++] = strdup(token);
+    }
+
+  free(line);
 
   gUniqueWorkloadPaths = i;
 
@@ -36,7 +50,7 @@ int workload_init(char *workload_path) {
   return EXIT_SUCCESS;
 }
 
-unsigned short int workload_num_unique_paths(){
+unsigned int workload_num_unique_paths(){
   return gUniqueWorkloadPaths;
 }
 
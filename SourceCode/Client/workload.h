@@ -20,7 +20,7 @@ int workload_set_mode(int mode);
 /*
  * Returns the number of unique paths in the workload
  */
-unsigned short int workload_num_unique_paths();
+unsigned int workload_num_unique_paths();
 
 /*
  * Returns a path from the workload.  Whether this is
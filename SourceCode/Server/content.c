@@ -4,46 +4,111 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <errno.h>
 
-#define MAX_KEYLEN 256
+#include "content_index.h"
 
 typedef struct{
 	int fildes;
-	char key[MAX_KEYLEN];
+	char *key;
 } item_t;
 
 static int nitems;
 static item_t *items;
 
+/* Set instead of items when content_init was given a binary index */
+static void *index_map;
+static size_t index_len;
+static const content_index_entry_t *index_entries;
+static const char *index_strings;
+static size_t index_strings_len;
+static int *index_fds;   /* fd + 1 of each entry, 0 until it is first requested */
+
 static int _itemcmp(const void *a, const void *b){
 	return strcmp(((item_t*) a)->key,((item_t*) b)->key);
 }
 
+/*
+ * Maps an index written by content_index.  Nothing is parsed or opened
+ * here, files are opened the first time they are requested, so start up
+ * takes the same time whatever the number of entries.
+ */
+static int _content_init_index(FILE *filelist){
+	struct stat st;
+	const content_index_header_t *header;
+
+	if( 0 > fstat(fileno(filelist), &st) || (size_t) st.st_size < sizeof(content_index_header_t)){
+		fprintf(stderr, "Content index is truncated.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	index_len = st.st_size;
+	if( MAP_FAILED == (index_map = mmap(NULL, index_len, PROT_READ, MAP_SHARED, fileno(filelist), 0))){
+		fprintf(stderr, "Unable to map content index.\n");
+		exit(EXIT_FAILURE);
+	}
+	fclose(filelist);
+
+	header = (const content_index_header_t*) index_map;
+	/* Entries must fit before the string table, and the table must end in a NUL so
+	   no string can run past the mapping. Offsets are checked as they are used. */
+	if( header->strings > index_len || header->strings < sizeof(*header) || header->nitems > INT_MAX ||
+		header->nitems > (header->strings - sizeof(*header)) / sizeof(content_index_entry_t) ||
+		(header->strings < index_len && ((const char*) index_map)[index_len - 1] != '\0')){
+		fprintf(stderr, "Content index is truncated.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	nitems = header->nitems;
+	index_entries = (const content_index_entry_t*) (header + 1);
+	index_strings = (const char*) index_map + header->strings;
+	index_strings_len = index_len - header->strings;
+	index_fds = (int*) calloc(nitems, sizeof(int));
+
+	return EXIT_SUCCESS;
+}
+
 int content_init(const char *filename){
 	FILE *filelist;
 	int capacity = 16;
-	char *path, *ptr;
+	char *line = NULL, *key, *path, *ptr;
+	size_t linecap = 0;
+	ssize_t linelen;
+	char magic[CONTENT_INDEX_MAGIC_LEN];
 
 	if( NULL == (filelist = fopen(filename, "r"))){
 		fprintf(stderr, "Unable to open file in content_init.\n");
 		exit(EXIT_FAILURE);
 	}
 
+	/* A binary index is mapped, anything else is read as a text content file */
+	if( sizeof(magic) == fread(magic, 1, sizeof(magic), filelist) &&
+		0 == memcmp(magic, CONTENT_INDEX_MAGIC, sizeof(magic)))
+		return _content_init_index(filelist);
+	rewind(filelist);
+
 	items = (item_t*) malloc(capacity * sizeof(item_t));
 	nitems = 0;
-	while(fgets(items[nitems].key, MAX_KEYLEN, filelist)){
+	/* The line buffer is reused, so keys and paths may be up to PATH_MAX long */
+	while(0 < (linelen = getline(&line, &linecap, filelist))){
 		/*Taking out EOL character*/
-		items[nitems].key[strlen(items[nitems].key)-1] = '\0';
+		if(line[linelen-1] == '\n')
+			line[linelen-1] = '\0';
 
 		/* Using space delimiter to sep key and path*/
-		ptr = items[nitems].key;
-		strsep(&ptr, " \t"); 		/* The key is first */
+		ptr = line;
+		key = strsep(&ptr, " \t"); 	/* The key is first */
 		path = strsep(&ptr, " \t"); /* The path second */
+		if(NULL == path)
+			continue;
 
 		if( 0 > (items[nitems].fildes = open(path, O_RDONLY))){
 			fprintf(stderr, "Unable to open file %s.\n", path);
 			exit(EXIT_FAILURE);
 		}
+		items[nitems].key = strdup(key);
 		nitems++;
 
 		if(nitems == capacity){
@@ -53,6 +118,7 @@ int content_init(const char *filename){
 
 	}
 
+	free(line);
 	fclose(filelist);
 
 	qsort(items, nitems, sizeof(item_t), _itemcmp);
@@ -60,28 +126,106 @@ int content_init(const char *filename){
 	return EXIT_SUCCESS;
 }
 
-int content_get(const char *key){
+/* Returns the string at offset off of the string table, NULL if off is outside it */
+static const char *_index_string(uint64_t off){
+	return (off < index_strings_len) ? index_strings + off : NULL;
+}
+
+/* Returns the fd of index entry i, opening it on first use */
+static int _index_fildes(int i){
+	int fildes = __atomic_load_n(&index_fds[i], __ATOMIC_ACQUIRE) - 1;
+	int unopened = 0;
+	const char *path;
+
+	if(fildes >= 0)
+		return fildes;
+
+	if( NULL == (path = _index_string(index_entries[i].path)) || 0 > (fildes = open(path, O_RDONLY)))
+		return -1;
+
+	/* Another thread may have opened it at the same time, keep the first */
+	if(!__atomic_compare_exchange_n(&index_fds[i], &unopened, fildes + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+		close(fildes);
+		fildes = unopened - 1;
+	}
+	return fildes;
+}
+
+/* Returns the position of key in the index or the items, -1 if it is not present */
+static int _content_find(const char *key){
 	int lo = 0;
 	int hi = nitems - 1;
 	int mid, cmp;
+	const char *entry;
+
 	while (lo <= hi) {
-		// Key is in items[lo..hi] or not present.
+		// Key is in [lo..hi] or not present.
 		mid = lo + (hi - lo) / 2;
-		cmp = strcmp(key,items[mid].key);
+		if(index_map){
+			if( NULL == (entry = _index_string(index_entries[mid].key)))
+				return -1;  /* corrupt entry, the search can't go on */
+		}
+		else
+			entry = items[mid].key;
+		cmp = strcmp(key, entry);
 		if ( cmp < 0) hi = mid - 1;
 		else if (cmp > 0) lo = mid + 1;
-		else{
-			lseek(items[mid].fildes, 0, SEEK_SET);
-			return items[mid].fildes;
-		} 
+		else return mid;
 	}
 	return -1;
 }
 
+int content_get(const char *key){
+	int i;
+
+	if( 0 > (i = _content_find(key)))
+		return -1;
+
+	if(index_map)
+		return _index_fildes(i);
+
+	lseek(items[i].fildes, 0, SEEK_SET);
+	return items[i].fildes;
+}
+
+int content_open(const char *key){
+	int i;
+	const char *path;
+
+	if( 0 > (i = _content_find(key))){
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* A text content file keeps every file open, hand out a copy of its fd */
+	if(!index_map)
+		return dup(items[i].fildes);
+
+	if( NULL == (path = _index_string(index_entries[i].path))){
+		errno = ENOENT;
+		return -1;
+	}
+	return open(path, O_RDONLY);
+}
+
 void content_destroy(){
 	int i;
-	for(i = 0; i < nitems; i++)
+
+	if(index_map){
+		for(i = 0; i < nitems; i++)
+			if(index_fds[i] > 0)
+				close(index_fds[i] - 1);
+
+		free(index_fds);
+		munmap(index_map, index_len);
+		index_map = NULL;
+		return;
+	}
+
+	for(i = 0; i < nitems; i++){
 		close(items[i].fildes);
+		free(items[i].key);
+	}
 	
 	free(items);
 }
\ No newline at end of file
@@ -7,6 +7,10 @@
  * to contain a key and a file path separated by a space.
  * See content.txt for an example.	
  *
+ * The file may instead be a binary index written by content_index,
+ * which is mapped rather than read.  The files it lists are opened
+ * when they are requested, see content_open.
+ *
  * Subsequent calls to content_get with a key value
  * as an argument will return the file descriptor for the 
  * given file path.
@@ -16,9 +20,20 @@ int content_init(const char *filename);
 /* 
  * Returns the file descriptor associated with the input key.
  * Returns -1 if the the key is not found
+ * With a binary index the file is opened on the first call for its key
+ * and stays open until content_destroy, so a server with many files
+ * should use content_open instead.
  */
 int content_get(const char *key);
 
+/*
+ * Returns a new file descriptor for the file of the input key, which the
+ * caller must close.  Returns -1 and sets errno to ENOENT if the key is
+ * not found, or leaves the errno of the failed open (EMFILE, EACCES, ...)
+ * if the key is found but its file can't be opened.
+ */
+int content_open(const char *key);
+
 /* 
  * Frees all memory and closes all file descriptors
  * associated with the cache.
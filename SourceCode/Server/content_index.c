@@ -0,0 +1,284 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "content_index.h"
+#include "steque.h"
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  content_index [options] content_dir index_file\n"                          \
+"Indexes every regular file under content_dir for gfserver_main -m.\n"        \
+"The key of a file is its path below content_dir, starting with '/'.\n"      \
+"options:\n"                                                                  \
+"  -t [nthreads]       Number of threads walking the tree (Default: 8)\n"     \
+"  -h                  Show this help message.\n"                             \
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] = {
+  {"nthreads",      required_argument,      NULL,           't'},
+  {"help",          no_argument,            NULL,           'h'},
+  {NULL,            0,                      NULL,             0}
+};
+
+// A file found by the walk
+typedef struct entry {
+  char *key;       /// path below the content directory, starting with '/'
+  uint64_t size;
+  int64_t mtime;
+} entry;
+
+// Files found by one walker thread, merged once the walk is done
+typedef struct walkResult {
+  entry *entries;
+  size_t n;
+  size_t capacity;
+} walkResult;
+
+// Global variables
+char *root;              // content directory, without a trailing '/'
+steque_t dirQueue;       // keys of directories still to be read
+int busyWalkers = 0;     // walkers reading a directory, the walk is done when 0 and dirQueue is empty
+pthread_mutex_t mutex_dq = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dq_changed = PTHREAD_COND_INITIALIZER;
+
+static int entryCmp(const void *a, const void *b) {
+  return strcmp(((entry*) a)->key, ((entry*) b)->key);
+}
+
+static char* joinKey(const char *dir, const char *name) {
+  size_t dirLen = strlen(dir);
+  char *key = (char*) malloc(dirLen + strlen(name) + 2);
+
+  memcpy(key, dir, dirLen);
+  key[dirLen] = '/';
+  strcpy(&key[dirLen + 1], name);
+  return key;
+}
+
+// Reads one directory, queues its subdirectories and records its files.
+static void readDirectory(const char *dirKey, walkResult *result) {
+  char *path = joinKey(root, dirKey);
+  DIR *dir = opendir(path);
+  struct dirent *de;
+  struct stat st;
+
+  if (dir == NULL) {
+    perror(path);
+    free(path);
+    return;
+  }
+
+  while (NULL != (de = readdir(dir))) {
+    if (0 == strcmp(de->d_name, ".") || 0 == strcmp(de->d_name, ".."))
+      continue;
+
+    // fstatat relative to the open directory avoids resolving the whole path again.
+    // Look at the entry itself first, d_type may be DT_UNKNOWN and can't tell a link.
+    if (0 > fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+      continue;
+
+    // A link to a file is indexed as that file, a link to a directory is not
+    // followed, it may loop or lead out of the tree.
+    if (S_ISLNK(st.st_mode) &&
+        (0 > fstatat(dirfd(dir), de->d_name, &st, 0) || S_ISDIR(st.st_mode)))
+      continue;
+
+    if (S_ISDIR(st.st_mode)) {
+      pthread_mutex_lock(&mutex_dq);
+      steque_enqueue(&dirQueue, (steque_item)joinKey(dirKey, de->d_name));
+      pthread_mutex_unlock(&mutex_dq);
+      pthread_cond_signal(&dq_changed);
+    }
+    else if (S_ISREG(st.st_mode)) {
+      if (result->n == result->capacity) {
+        result->capacity = result->capacity ? result->capacity * 2 : 1024;
+        result->entries = (entry*) realloc(result->entries, result->capacity * sizeof(entry));
+      }
+      result->entries[result->n].key = joinKey(dirKey, de->d_name);
+      result->entries[result->n].size = st.st_size;
+      result->entries[result->n].mtime = st.st_mtime;
+      result->n++;
+    }
+  }
+
+  closedir(dir);
+  free(path);
+}
+
+// Walker thread, takes directories off the queue until the whole tree is read
+void* walkHandler(void *arg) {
+  walkResult *result = (walkResult*) arg;
+  char *dirKey;
+
+  while (1) {
+    pthread_mutex_lock(&mutex_dq);
+    while (steque_isempty(&dirQueue) && busyWalkers > 0) {
+      pthread_cond_wait(&dq_changed, &mutex_dq);
+    }
+    if (steque_isempty(&dirQueue)) {  // nothing queued and nobody left to queue more
+      pthread_mutex_unlock(&mutex_dq);
+      pthread_cond_broadcast(&dq_changed);
+      return NULL;
+    }
+    dirKey = (char*) steque_pop(&dirQueue);
+    busyWalkers++;
+    pthread_mutex_unlock(&mutex_dq);
+
+    readDirectory(dirKey, result);
+    free(dirKey);
+
+    pthread_mutex_lock(&mutex_dq);
+    busyWalkers--;
+    pthread_mutex_unlock(&mutex_dq);
+    pthread_cond_broadcast(&dq_changed);
+  }
+}
+
+// Writes len bytes to the index being built, giving up on the whole index on error
+static void writeOrDie(const void *data, size_t len, FILE *out, const char *tmpname) {
+  if (len > 0 && fwrite(data, len, 1, out) != 1) {
+    perror(tmpname);
+    unlink(tmpname);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Writes the sorted entries in the layout described in content_index.h. The index is
+// built in a temporary file next to filename and renamed over it once complete, so a
+// running server or a failed write never sees a partial index.
+static void writeIndex(const char *filename, entry *entries, size_t n) {
+  content_index_header_t header;
+  content_index_entry_t record;
+  uint64_t offset = 0;
+  size_t rootLen = strlen(root);
+  char *tmpname = (char*) malloc(strlen(filename) + 8);
+  int fd;
+  FILE *out;
+
+  sprintf(tmpname, "%s.XXXXXX", filename);
+  if (0 > (fd = mkstemp(tmpname)) || NULL == (out = fdopen(fd, "w"))) {
+    perror(tmpname);
+    exit(EXIT_FAILURE);
+  }
+
+  memcpy(header.magic, CONTENT_INDEX_MAGIC, CONTENT_INDEX_MAGIC_LEN);
+  header.nitems = n;
+  header.strings = sizeof(header) + n * sizeof(record);
+  writeOrDie(&header, sizeof(header), out, tmpname);
+
+  // Each entry has its key, then its path (root followed by the key) in the string table
+  for (size_t i = 0; i < n; i++) {
+    record.key = offset;
+    offset += strlen(entries[i].key) + 1;
+    record.path = offset;
+    offset += rootLen + strlen(entries[i].key) + 1;
+    record.size = entries[i].size;
+    record.mtime = entries[i].mtime;
+    writeOrDie(&record, sizeof(record), out, tmpname);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    writeOrDie(entries[i].key, strlen(entries[i].key) + 1, out, tmpname);
+    writeOrDie(root, rootLen, out, tmpname);
+    writeOrDie(entries[i].key, strlen(entries[i].key) + 1, out, tmpname);
+  }
+
+  if (0 != fflush(out) || 0 != fsync(fd) || 0 != fclose(out)) {
+    perror(tmpname);
+    unlink(tmpname);
+    exit(EXIT_FAILURE);
+  }
+  // mkstemp creates the file 0600, give the index the usual permissions
+  if (0 > chmod(tmpname, 0644) || 0 > rename(tmpname, filename)) {
+    perror(filename);
+    unlink(tmpname);
+    exit(EXIT_FAILURE);
+  }
+  free(tmpname);
+}
+
+/* Main ========================================================= */
+int main(int argc, char **argv) {
+  int option_char = 0;
+  int nthreads = 8;
+  pthread_t *walkers;
+  walkResult *results;
+  entry *entries;
+  size_t n = 0;
+
+  while ((option_char = getopt_long(argc, argv, "t:h", gLongOptions, NULL)) != -1) {
+    switch (option_char) {
+      case 't': // nthreads
+        nthreads = atoi(optarg);
+        break;
+      case 'h': // help
+        fprintf(stdout, "%s", USAGE);
+        exit(0);
+        break;
+      default:
+        fprintf(stderr, "%s", USAGE);
+        exit(1);
+    }
+  }
+
+  if (argc - optind != 2) {
+    fprintf(stderr, "%s", USAGE);
+    exit(1);
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+
+  // Keys start with '/', so drop any trailing '/' from the root
+  root = strdup(argv[optind]);
+  while (strlen(root) > 1 && root[strlen(root) - 1] == '/') {
+    root[strlen(root) - 1] = '\0';
+  }
+
+  // Walk the tree, each thread keeps its own list of files
+  steque_init(&dirQueue);
+  steque_enqueue(&dirQueue, (steque_item)strdup(""));
+  walkers = (pthread_t*) malloc(nthreads * sizeof(pthread_t));
+  results = (walkResult*) calloc(nthreads, sizeof(walkResult));
+  for (int i = 0; i < nthreads; i++) {
+    pthread_create(&walkers[i], NULL, &walkHandler, &results[i]);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(walkers[i], NULL);
+    n += results[i].n;
+  }
+
+  // Merge and sort by key, content_get does a binary search over the index
+  entries = (entry*) malloc((n ? n : 1) * sizeof(entry));
+  n = 0;
+  for (int i = 0; i < nthreads; i++) {
+    if (results[i].n > 0) {
+      memcpy(&entries[n], results[i].entries, results[i].n * sizeof(entry));
+      n += results[i].n;
+    }
+    free(results[i].entries);
+  }
+  qsort(entries, n, sizeof(entry), entryCmp);
+
+  writeIndex(argv[optind + 1], entries, n);
+  fprintf(stdout, "Indexed %zu files.\n", n);
+
+  for (size_t i = 0; i < n; i++) {
+    free(entries[i].key);
+  }
+  free(entries);
+  free(results);
+  free(walkers);
+  steque_destroy(&dirQueue);
+
+  return 0;
+}
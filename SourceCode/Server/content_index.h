@@ -0,0 +1,29 @@
+#ifndef __CONTENT_INDEX_H__
+#define __CONTENT_INDEX_H__
+
+#include <stdint.h>
+
+/*
+ * On-disk layout of a binary content index, as written by content_index
+ * and mapped by content_init.  The file is a header, then nitems entries
+ * sorted by key (strcmp order), then a table of NUL-terminated strings
+ * that the entries refer to by offset.  All integers are in host order.
+ */
+
+#define CONTENT_INDEX_MAGIC "GFIDX001"
+#define CONTENT_INDEX_MAGIC_LEN 8
+
+typedef struct{
+	char magic[CONTENT_INDEX_MAGIC_LEN];
+	uint64_t nitems;
+	uint64_t strings;   /* file offset of the string table */
+} content_index_header_t;
+
+typedef struct{
+	uint64_t key;       /* offset of the key in the string table */
+	uint64_t path;      /* offset of the file path in the string table */
+	uint64_t size;      /* file size when indexed */
+	int64_t mtime;      /* modification time when indexed, used as the version */
+} content_index_entry_t;
+
+#endif
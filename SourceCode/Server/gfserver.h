@@ -7,7 +7,10 @@
  * protocol.
  */
 
-#define MAX_REQUEST_LEN 128
+#include <limits.h>
+
+/* "GETFILE GET " + path + "\r\n\r\n", paths may be up to PATH_MAX long */
+#define MAX_REQUEST_LEN (PATH_MAX + 16)
 
 typedef int gfstatus_t;
 
@@ -23,6 +23,8 @@
 "  -t [nthreads]       Number of threads (Default: 64)\n"                      \
 "  -p [listen_port]    Listen port (Default: 12041)\n"                         \
 "  -m [content_file]   Content file mapping keys to content files\n"          \
+"  -r [bytes_per_sec]  Send rate per connection (Default: 0, unlimited)\n"    \
+"  -R [bytes_per_sec]  Send rate of the whole server (Default: 0, unlimited)\n"\
 "  -h                  Show this help message.\n"                             \
 
 /* OPTIONS DESCRIPTOR ====================================================== */
@@ -30,6 +32,8 @@ static struct option gLongOptions[] = {
   {"port",          required_argument,      NULL,           'p'},
   {"nthreads",      required_argument,      NULL,           't'},
   {"content",       required_argument,      NULL,           'm'},
+  {"rate",          required_argument,      NULL,           'r'},
+  {"server-rate",   required_argument,      NULL,           'R'},
   {"help",          no_argument,            NULL,           'h'},
   {NULL,            0,                      NULL,             0}
 };
@@ -38,6 +42,9 @@ static struct option gLongOptions[] = {
 extern void initRequestQueue(void);
 extern void createWorkerThreads(int nthreads);  // defined in handler.c
 extern ssize_t gfs_handler(gfcontext_t *ctx, const char *path, void* arg);
+extern void setTransferRates(size_t perConnection, size_t perServer);
+extern void printThrottleStats(void);
+extern void printPoolStats(void);
 
 static void _sig_handler(int signo){
   if ((SIGINT == signo) || (SIGTERM == signo)) {
@@ -52,6 +59,8 @@ int main(int argc, char **argv) {
   char *content_map = "content.txt";
   gfserver_t *gfs = NULL;
   int nthreads = 64;
+  size_t connection_rate = 0;
+  size_t server_rate = 0;
 
   setbuf(stdout, NULL);
 
@@ -66,7 +75,7 @@ int main(int argc, char **argv) {
   }
 
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "t:m:xp:h", gLongOptions, NULL)) != -1) {
+  while ((option_char = getopt_long(argc, argv, "t:m:xp:r:R:h", gLongOptions, NULL)) != -1) {
     switch (option_char) {
       case 'p': // listen-port
         port = atoi(optarg);
@@ -84,6 +93,12 @@ int main(int argc, char **argv) {
       case 'm': // file-path
         content_map = optarg;
         break;                                          
+      case 'r': // rate
+        connection_rate = strtoull(optarg, NULL, 10);
+        break;
+      case 'R': // server-rate
+        server_rate = strtoull(optarg, NULL, 10);
+        break;
     }
   }
   
@@ -94,12 +109,21 @@ int main(int argc, char **argv) {
 
   content_init(content_map);
 
+  // Initialize the request queue before any worker can look at it, report the
+  // pool sizes when the server is stopped
+  initRequestQueue();
+  atexit(printPoolStats);
+
+  // Rate limits, report the time spent throttled when the server is stopped.
+  // Set before the workers start, they size their chunks from them.
+  setTransferRates(connection_rate, server_rate);
+  if (connection_rate > 0 || server_rate > 0) {
+    atexit(printThrottleStats);
+  }
+
   // Create worker thread pool
   createWorkerThreads(nthreads);
 
-  // Initialize the request queue
-  initRequestQueue();
-
   /*Initializing server*/
   gfs = gfserver_create();
 